@@ -0,0 +1,298 @@
+/**
+ * @file benchmark.c
+ * @brief FTP RETR throughput benchmark
+ *
+ * Downloads a file from the ftp server with RETR, over plaintext or after AUTH TLS,
+ * and reports the best throughput of a few downloads. Run through benchmark.sh to compare plaintext,
+ * userspace TLS and kernel TLS. With -r it instead reconnects repeatedly and reports the rate of
+ * connections with full TLS handshakes against connections resuming the previous session.
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+// method declarations
+void sendCommand(int ftpClientSocket, char *command);
+int receiveData(int ftpClientSocket, char *buffer, int size);
+int connectToServer(void);
+void upgradeToTls(int ftpClientSocket, SSL_CTX *tlsContext, SSL_SESSION *resumedSession);
+void logIn(int ftpClientSocket);
+void logOut(int ftpClientSocket);
+SSL_CTX *createTlsContext(char *caFile);
+void reconnectBenchmark(int connections, char *caFile);
+
+// connect to the ftp server on port 3111
+#define PORT 3111
+#define SERVER_ADDRESS "127.0.0.1"
+// give up when the server sends nothing for this long, e.g. when the file does not exist
+#define RECEIVE_TIMEOUT_SECONDS 10
+// the file is downloaded this many times on the same connection and the fastest download is reported
+#define DOWNLOAD_REPEATS 3
+
+// TLS session with the server, NULL for the plaintext benchmark
+SSL *ftpClientTls = NULL;
+
+int main(int argc, char *argv[])
+{
+    // Intialize variables
+    char buffer[65536];
+    char command[1024];
+    char *caFile = NULL;
+    struct timespec startTime, endTime;
+
+    // reconnect benchmark, the number of connections and the CA file are passed
+    if (argc == 4 && strcmp(argv[1], "-r") == 0)
+    {
+        reconnectBenchmark(atoi(argv[2]), argv[3]);
+        return 0;
+    }
+    // check the arguments, the file is downloaded over TLS when a CA file is passed
+    if (argc == 5 && strcmp(argv[3], "-t") == 0)
+    {
+        caFile = argv[4];
+    }
+    else if (argc != 3)
+    {
+        printf("Invalid command format. Please type in following format - %s [<./benchmark> <FileName> <FileSize> [-t <CAFile>] | <./benchmark> -r <Connections> <CAFile>]\n", argv[0]);
+        exit(1);
+    }
+    long long fileSize = atoll(argv[2]);
+
+    // upgrade to TLS before logging in
+    int ftpClientSocket = connectToServer();
+    if (caFile != NULL)
+    {
+        upgradeToTls(ftpClientSocket, createTlsContext(caFile), NULL);
+    }
+    logIn(ftpClientSocket);
+
+    // download the whole file and time it
+    snprintf(command, sizeof(command), "RETR %s\n", argv[1]);
+    double bestSeconds = 0;
+    for (int repeat = 0; repeat < DOWNLOAD_REPEATS; repeat++)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &startTime);
+        sendCommand(ftpClientSocket, command);
+        long long receivedBytes = 0;
+        while (receivedBytes < fileSize)
+        {
+            int noOfBytes = receiveData(ftpClientSocket, buffer, sizeof(buffer));
+            if (noOfBytes <= 0)
+            {
+                printf("Download stopped after %lld of %lld bytes...(\n", receivedBytes, fileSize);
+                exit(1);
+            }
+            receivedBytes += noOfBytes;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &endTime);
+        double seconds = (endTime.tv_sec - startTime.tv_sec) + (endTime.tv_nsec - startTime.tv_nsec) / 1e9;
+        if (repeat == 0 || seconds < bestSeconds)
+        {
+            bestSeconds = seconds;
+        }
+    }
+    printf("%lld bytes in %.3f s, %.1f MB/s\n", fileSize, bestSeconds, fileSize / bestSeconds / (1024 * 1024));
+    logOut(ftpClientSocket);
+    return 0;
+}
+
+/**
+ * @brief This method will open the control connection to the server.
+ *
+ * @return connected socket
+ */
+int connectToServer(void)
+{
+    struct sockaddr_in serverAddressData;
+    struct timeval receiveTimeout = {.tv_sec = RECEIVE_TIMEOUT_SECONDS};
+    int ftpClientSocket = socket(AF_INET, SOCK_STREAM, 0);
+    memset(&serverAddressData, '\0', sizeof(serverAddressData));
+    serverAddressData.sin_family = AF_INET;
+    serverAddressData.sin_port = htons(PORT);
+    serverAddressData.sin_addr.s_addr = inet_addr(SERVER_ADDRESS);
+    if (ftpClientSocket == -1 || connect(ftpClientSocket, (struct sockaddr *)&serverAddressData, sizeof(serverAddressData)) == -1)
+    {
+        printf("Failed to connect to ftp server...(\n");
+        exit(1);
+    }
+    setsockopt(ftpClientSocket, SOL_SOCKET, SO_RCVTIMEO, &receiveTimeout, sizeof(receiveTimeout));
+    return ftpClientSocket;
+}
+
+/**
+ * @brief This method will send AUTH TLS and run the TLS handshake, offering the given session for resumption.
+ *
+ * @param ftpClientSocket
+ * @param tlsContext
+ * @param resumedSession session of an earlier connection, or NULL for a full handshake
+ */
+void upgradeToTls(int ftpClientSocket, SSL_CTX *tlsContext, SSL_SESSION *resumedSession)
+{
+    char buffer[1024];
+    sendCommand(ftpClientSocket, "AUTH TLS\n");
+    if (receiveData(ftpClientSocket, buffer, sizeof(buffer) - 1) <= 0 || strncmp(buffer, "Code[234]", 9) != 0)
+    {
+        printf("Server refused AUTH TLS...(\n");
+        exit(1);
+    }
+    ftpClientTls = SSL_new(tlsContext);
+    if (ftpClientTls == NULL || X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(ftpClientTls), SERVER_ADDRESS) != 1 || SSL_set_fd(ftpClientTls, ftpClientSocket) != 1)
+    {
+        printf("Failed to negotiate TLS with ftp server...(\n");
+        exit(1);
+    }
+    if (resumedSession != NULL)
+    {
+        SSL_set_session(ftpClientTls, resumedSession);
+    }
+    if (SSL_connect(ftpClientTls) <= 0)
+    {
+        printf("Failed to negotiate TLS with ftp server...(\n");
+        ERR_print_errors_fp(stderr);
+        exit(1);
+    }
+}
+
+/**
+ * @brief This method will log in to the server.
+ *
+ * @param ftpClientSocket
+ */
+void logIn(int ftpClientSocket)
+{
+    char buffer[1024];
+    sendCommand(ftpClientSocket, "USER benchmark\n");
+    if (receiveData(ftpClientSocket, buffer, sizeof(buffer) - 1) <= 0)
+    {
+        printf("Failed to log in to ftp server...(\n");
+        exit(1);
+    }
+}
+
+/**
+ * @brief This method will log out like the client does and close the connection.
+ *
+ * @param ftpClientSocket
+ */
+void logOut(int ftpClientSocket)
+{
+    sendCommand(ftpClientSocket, "QUIT\n");
+    if (ftpClientTls != NULL)
+    {
+        SSL_shutdown(ftpClientTls);
+        SSL_free(ftpClientTls);
+        ftpClientTls = NULL;
+    }
+    close(ftpClientSocket);
+}
+
+/**
+ * @brief This method will connect, upgrade to TLS and log in repeatedly, first with full handshakes
+ * and then resuming the session of the previous connection, and report the connection rate of each.
+ *
+ * @param connections
+ * @param caFile
+ */
+void reconnectBenchmark(int connections, char *caFile)
+{
+    struct timespec startTime, endTime;
+    SSL_CTX *tlsContext = createTlsContext(caFile);
+    SSL_SESSION *previousSession = NULL;
+    for (int resume = 0; resume <= 1; resume++)
+    {
+        int resumedConnections = 0;
+        clock_gettime(CLOCK_MONOTONIC, &startTime);
+        for (int connection = 0; connection < connections; connection++)
+        {
+            int ftpClientSocket = connectToServer();
+            upgradeToTls(ftpClientSocket, tlsContext, resume ? previousSession : NULL);
+            // the session ticket is sent after the handshake, reading the login reply receives it
+            logIn(ftpClientSocket);
+            if (SSL_session_reused(ftpClientTls))
+            {
+                resumedConnections++;
+            }
+            SSL_SESSION_free(previousSession);
+            previousSession = SSL_get1_session(ftpClientTls);
+            logOut(ftpClientSocket);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &endTime);
+        double seconds = (endTime.tv_sec - startTime.tv_sec) + (endTime.tv_nsec - startTime.tv_nsec) / 1e9;
+        printf("%s handshakes: %d connections in %.3f s, %.1f/s, %d resumed\n", resume ? "resumed" : "full", connections, seconds, connections / seconds, resumedConnections);
+    }
+    SSL_SESSION_free(previousSession);
+    SSL_CTX_free(tlsContext);
+}
+
+/**
+ * @brief This method will send the command to the server, through the TLS session if there is one
+ *
+ * @param ftpClientSocket
+ * @param command
+ */
+void sendCommand(int ftpClientSocket, char *command)
+{
+    if (ftpClientTls != NULL)
+    {
+        SSL_write(ftpClientTls, command, strlen(command));
+    }
+    else
+    {
+        send(ftpClientSocket, command, strlen(command), 0);
+    }
+}
+
+/**
+ * @brief This method will receive data from the server, through the TLS session if there is one
+ *
+ * @param ftpClientSocket
+ * @param buffer
+ * @param size
+ * @return number of bytes received, 0 on disconnect and -1 on failure
+ */
+int receiveData(int ftpClientSocket, char *buffer, int size)
+{
+    int noOfBytes;
+    if (ftpClientTls != NULL)
+    {
+        noOfBytes = SSL_read(ftpClientTls, buffer, size);
+    }
+    else
+    {
+        noOfBytes = recv(ftpClientSocket, buffer, size, 0);
+    }
+    // terminate replies so they can be compared as strings
+    if (noOfBytes > 0 && noOfBytes < size)
+    {
+        buffer[noOfBytes] = '\0';
+    }
+    return noOfBytes;
+}
+
+/**
+ * @brief This method will create the TLS context verifying the server certificate against the CA file.
+ *
+ * @param caFile
+ * @return TLS context
+ */
+SSL_CTX *createTlsContext(char *caFile)
+{
+    SSL_CTX *tlsContext = SSL_CTX_new(TLS_client_method());
+    if (tlsContext == NULL || SSL_CTX_load_verify_locations(tlsContext, caFile, NULL) != 1)
+    {
+        printf("Failed to load CA file %s...(\n", caFile);
+        exit(1);
+    }
+    SSL_CTX_set_min_proto_version(tlsContext, TLS1_2_VERSION);
+    SSL_CTX_set_verify(tlsContext, SSL_VERIFY_PEER, NULL);
+    return tlsContext;
+}
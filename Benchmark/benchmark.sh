@@ -0,0 +1,50 @@
+#!/bin/sh
+# Compares RETR throughput of plaintext (sendfile), with and without a cap on the unsent data of a session,
+# userspace TLS and kernel TLS (SSL_sendfile) on loopback, then the connection rate with full and with resumed TLS handshakes.
+# Usage: Benchmark/benchmark.sh [FileSizeMB] [Connections]
+set -e
+cd "$(dirname "$0")/.."
+fileSizeMb=${1:-256}
+fileSize=$((fileSizeMb * 1024 * 1024))
+connections=${2:-500}
+workDirectory=$(mktemp -d)
+serverPid=
+trap '[ -n "$serverPid" ] && kill $serverPid 2>/dev/null; rm -rf "$workDirectory"' EXIT
+
+gcc -O2 -o "$workDirectory/server" Server/server.c -lssl -lcrypto -pthread
+gcc -O2 -o "$workDirectory/benchmark" Benchmark/benchmark.c -lssl -lcrypto
+mkdir "$workDirectory/home"
+head -c "$fileSize" /dev/urandom > "$workDirectory/home/benchmark.bin"
+openssl req -x509 -newkey rsa:2048 -nodes -keyout "$workDirectory/key.pem" -out "$workDirectory/cert.pem" \
+  -days 1 -subj /CN=localhost -addext subjectAltName=IP:127.0.0.1 2>/dev/null
+# kernel TLS needs the tls module, the kTLS run reports when the server could not use it
+modprobe tls 2>/dev/null || true
+
+# runBenchmark <Mode> <ServerEnvironment> <BenchmarkArguments>...
+runBenchmark()
+{
+  mode=$1
+  serverEnvironment=$2
+  shift 2
+  (cd "$workDirectory/home" && exec env $serverEnvironment "$workDirectory/server" -d "$workDirectory/home/" \
+    -c "$workDirectory/cert.pem" -k "$workDirectory/key.pem") > "$workDirectory/server.log" 2>&1 &
+  serverPid=$!
+  sleep 0.5
+  result=$("$workDirectory/benchmark" "$@" || true)
+  sleep 0.2
+  kill $serverPid
+  wait $serverPid 2>/dev/null || true
+  serverPid=
+  if [ "$mode" = "kernel TLS" ] && grep -q "kernel TLS off" "$workDirectory/server.log"; then
+    result="$result (kernel TLS unavailable, measured userspace TLS)"
+  fi
+  printf "%s\n" "$result" | while read -r line; do
+    printf "%-22s %s\n" "$mode" "$line"
+  done
+}
+
+runBenchmark "plaintext" "" benchmark.bin "$fileSize"
+runBenchmark "plaintext, 128K unsent" "FTP_SESSION_UNSENT_BYTES=131072" benchmark.bin "$fileSize"
+runBenchmark "userspace TLS" "FTP_DISABLE_KTLS=1" benchmark.bin "$fileSize" -t "$workDirectory/cert.pem"
+runBenchmark "kernel TLS" "" benchmark.bin "$fileSize" -t "$workDirectory/cert.pem"
+runBenchmark "TLS reconnect" "" -r "$connections" "$workDirectory/cert.pem"
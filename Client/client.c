@@ -17,20 +17,43 @@
 #include <sys/types.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <signal.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
 
 // method declarations
 void userNotLogged(char *buffer);
 void downloadFileToClient(char *tempBuffer, char *buffer);
+void startTlsSession(int ftpClientSocket, char *caFile);
+void sendDataToServer(int ftpClientSocket, char *buffer);
+int receiveDataFromServer(int ftpClientSocket, char *buffer, int size);
 
 // bind to port 3111
 #define PORT 3111
+// address of the ftp server, also checked against the server certificate on AUTH TLS
+#define SERVER_ADDRESS "127.0.0.1"
+
+// TLS session with the server, NULL while the connection is plaintext
+SSL *ftpClientTls = NULL;
 
 int main(int argc, char *argv[])
 {
     // Intialize variables
     char buffer[1024];
+    char *caFile = NULL;
     struct sockaddr_in serverAddressData;
 
+    // optional CA file used instead of the system trust store to verify the server certificate on AUTH TLS
+    if (argc == 3 && strcmp(argv[1], "-c") == 0)
+    {
+        caFile = argv[2];
+    }
+    else if (argc != 1)
+    {
+        printf("Invalid command format. Please type in following format - %s [<./client> [-c <CAFile>]]\n", argv[0]);
+        exit(1);
+    }
+
     // create socket connection
     int ftpClientSocket = socket(AF_INET, SOCK_STREAM, 0);
     // on successful socket creation
@@ -44,11 +67,13 @@ int main(int argc, char *argv[])
         printf("Failed to connect to ftp server...(\n");
         exit(1);
     }
+    // a closed connection is reported by recv instead of killing the client on send
+    signal(SIGPIPE, SIG_IGN);
     // clear the memory of address data
     memset(&serverAddressData, '\0', sizeof(serverAddressData));
     serverAddressData.sin_family = AF_INET;
     serverAddressData.sin_port = htons(PORT);
-    serverAddressData.sin_addr.s_addr = inet_addr("127.0.0.1");
+    serverAddressData.sin_addr.s_addr = inet_addr(SERVER_ADDRESS);
 
     // create the connection
     int ftpClientConnectionStatus = connect(ftpClientSocket, (struct sockaddr *)&serverAddressData, sizeof(serverAddressData));
@@ -74,7 +99,7 @@ int main(int argc, char *argv[])
         // add the string null terminator
         buffer[strlen(buffer)] = '\0';
         // send the commands to the server
-        send(ftpClientSocket, buffer, strlen(buffer), 0);
+        sendDataToServer(ftpClientSocket, buffer);
         // clear the tempbuffer and buffer char arrays
         bzero(tempBuffer, sizeof(tempBuffer));
         strcpy(tempBuffer, buffer);
@@ -82,6 +107,12 @@ int main(int argc, char *argv[])
         // On receiving QUIT and ABOR command
         if (strncmp(tempBuffer, "QUIT", 4) == 0 || strncmp(tempBuffer, "quit", 4) == 0 || strncmp(tempBuffer, "ABOR", 4) == 0 || strncmp(tempBuffer, "abor", 4) == 0)
         {
+            // close the TLS session before the socket
+            if (ftpClientTls != NULL)
+            {
+                SSL_shutdown(ftpClientTls);
+                SSL_free(ftpClientTls);
+            }
             close(ftpClientSocket);
             printf("Successfully disconnected from ftp server...)\n");
             exit(1);
@@ -89,12 +120,19 @@ int main(int argc, char *argv[])
         else
         {
             // recieve the meesage from server
-            int clientRecieveStatus = recv(ftpClientSocket, buffer, 1024, 0);
+            int clientRecieveStatus = receiveDataFromServer(ftpClientSocket, buffer, 1024);
             // on failure to receive
             if (clientRecieveStatus <= -1)
             {
                 printf("Failed to receive data from ftp server...(\n");
             }
+            // the server closed the connection, e.g. after an idle timeout
+            else if (clientRecieveStatus == 0)
+            {
+                close(ftpClientSocket);
+                printf("Connection closed by ftp server...(\n");
+                exit(1);
+            }
             // check for RETR/retr command to downlaod the file to the client
             else if (strncmp(tempBuffer, "RETR ", 5) == 0 || strncmp(tempBuffer, "retr ", 5) == 0)
             {
@@ -112,6 +150,16 @@ int main(int argc, char *argv[])
                 // clear the buffer
                 bzero(buffer, sizeof(buffer));
             }
+            // check for AUTH TLS/auth tls command to start the TLS handshake
+            else if (strncmp(tempBuffer, "AUTH TLS", 8) == 0 || strncmp(tempBuffer, "auth tls", 8) == 0)
+            {
+                printf("$ ftp server: \t%s\n", buffer);
+                if (strncmp(buffer, "Code[234]", 9) == 0)
+                {
+                    startTlsSession(ftpClientSocket, caFile);
+                }
+                bzero(buffer, sizeof(buffer));
+            }
             else
             {
                 // for other commands display the response status code with message
@@ -178,4 +226,85 @@ void userNotLogged(char *buffer)
     // clear the buffer
     memset(buffer, '\0', strlen(buffer));
     printf("Code[530]: No user logged in...:(\n");
-}
\ No newline at end of file
+}
+
+/**
+ * @brief This method will send the command to the server, encrypting it when TLS is negotiated
+ *
+ * @param ftpClientSocket
+ * @param buffer
+ */
+void sendDataToServer(int ftpClientSocket, char *buffer)
+{
+    if (ftpClientTls != NULL)
+    {
+        SSL_write(ftpClientTls, buffer, strlen(buffer));
+    }
+    else
+    {
+        send(ftpClientSocket, buffer, strlen(buffer), 0);
+    }
+}
+
+/**
+ * @brief This method will receive the reply from the server, decrypting it when TLS is negotiated
+ *
+ * @param ftpClientSocket
+ * @param buffer
+ * @param size
+ * @return number of bytes received, 0 on disconnect and -1 on failure
+ */
+int receiveDataFromServer(int ftpClientSocket, char *buffer, int size)
+{
+    if (ftpClientTls != NULL)
+    {
+        return SSL_read(ftpClientTls, buffer, size);
+    }
+    return recv(ftpClientSocket, buffer, size, 0);
+}
+
+/**
+ * @brief This method will run the TLS handshake after the server accepted auth tls command.
+ * The server certificate is verified against the passed CA file, or the system trust store when none is
+ * passed, and must be issued for the server address.
+ *
+ * @param ftpClientSocket
+ * @param caFile
+ */
+void startTlsSession(int ftpClientSocket, char *caFile)
+{
+    SSL_CTX *tlsContext = SSL_CTX_new(TLS_client_method());
+    if (tlsContext == NULL)
+    {
+        printf("Failed to create TLS context...(\n");
+        exit(1);
+    }
+    SSL_CTX_set_min_proto_version(tlsContext, TLS1_2_VERSION);
+    SSL_CTX_set_options(tlsContext, SSL_OP_ENABLE_KTLS);
+    if (caFile != NULL && SSL_CTX_load_verify_locations(tlsContext, caFile, NULL) != 1)
+    {
+        printf("Failed to load CA file %s...(\n", caFile);
+        exit(1);
+    }
+    else if (caFile == NULL && SSL_CTX_set_default_verify_paths(tlsContext) != 1)
+    {
+        printf("Failed to load system trust store...(\n");
+        exit(1);
+    }
+    SSL_CTX_set_verify(tlsContext, SSL_VERIFY_PEER, NULL);
+    ftpClientTls = SSL_new(tlsContext);
+    // the connection can not go back to plaintext after a failed handshake or an untrusted certificate
+    if (ftpClientTls == NULL || X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(ftpClientTls), SERVER_ADDRESS) != 1 || SSL_set_fd(ftpClientTls, ftpClientSocket) != 1 || SSL_connect(ftpClientTls) <= 0)
+    {
+        printf("Failed to negotiate TLS with ftp server...(\n");
+        if (ftpClientTls != NULL && SSL_get_verify_result(ftpClientTls) != X509_V_OK)
+        {
+            printf("Server certificate is not trusted: %s\n", X509_verify_cert_error_string(SSL_get_verify_result(ftpClientTls)));
+        }
+        ERR_print_errors_fp(stderr);
+        exit(1);
+    }
+    // the session keeps its own reference to the context
+    SSL_CTX_free(tlsContext);
+    printf("TLS negotiated using %s...)\n", SSL_get_version(ftpClientTls));
+}
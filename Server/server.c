@@ -8,6 +8,7 @@
  * @copyright Copyright (c) 2022 - COMP8567-3-R-2022S Advanced Systems Programming , School of Computer Science - University of Windsor.
  *
  */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -25,6 +26,20 @@
 #include <time.h>
 #include <sys/ipc.h>
 #include <sys/shm.h>
+#include <sys/sendfile.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <netinet/tcp.h>
+#include <limits.h>
+#include <sys/file.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
 
 // method declarations
 void resetBufferMemory(char *buffer);
@@ -40,9 +55,125 @@ void cwdCommand(int serverSocket, char *buffer, char *serverHomeDirectory);
 void storCommand(int serverSocket, char *buffer, char *serverHomeDirectory);
 void listCommand(char *serverHomeDirectory, char *buffer, int serverSocket);
 void retrCommand(int ftpServerSocket, char *buffer, char *serverHomeDirectory);
+void authTlsCommand(int ftpServerSocket, char *buffer);
+void closeTlsSession(void);
+int receiveDataFromClient(int ftpServerSocket, char *buffer, int size);
+bool sendToClient(int ftpServerSocket, char *data, size_t length);
+bool checkTransferRate(struct timespec *sendStartTime, ssize_t sentBytes);
+void configureSessionSocket(int ftpServerSocket);
+SSL_CTX *createTlsContext(char *certificateFile, char *privateKeyFile);
+void reloadSignalHandler(int signalNumber);
+int startNewServer(int serverSocketFileDesc, char *argv[]);
+void drainSessionsAndExit(int serverSocketFileDesc);
+int startAuditLog(void);
+void stopAuditLog(void);
+struct auditSlot *acquireAuditSlot(uint64_t sessionId);
+void auditCommand(char *command, struct timespec *startTime);
+void *auditWriterLoop(void *argument);
+void finishAuditSession(pid_t sessionPid);
+void reportUnauditedSession(uint64_t sessionId, pid_t sessionPid);
+void reapSessionChildren(void);
+void childExitSignalHandler(int signalNumber);
 
 // bind the server with port 3111
 #define PORT 3111
+// environment variable carrying the listening socket to a reloaded server
+#define LISTEN_FD_ENV "FTP_LISTEN_FD"
+// environment variable carrying the pipe a reloaded server writes to once it is accepting connections
+#define READY_FD_ENV "FTP_READY_FD"
+// environment variable carrying the pipe that passes the session ticket keys to a reloaded server
+#define TICKET_KEYS_FD_ENV "FTP_TICKET_KEYS_FD"
+#define TICKET_KEYS_BYTES 80
+// connections queued on the listening socket, large enough that bursts and reloads do not drop SYNs
+#define LISTEN_BACKLOG SOMAXCONN
+// environment variable that keeps TLS in user space, used to compare it with kernel TLS
+#define DISABLE_KTLS_ENV "FTP_DISABLE_KTLS"
+// file data read per send when RETR can not use sendfile, one full TLS record
+#define RETR_CHUNK_BYTES 16384
+// sessions are closed after this long without a command, or when a send makes no progress for the transfer timeout
+#define IDLE_TIMEOUT_SECONDS 300
+#define TRANSFER_TIMEOUT_SECONDS 60
+// over each transfer timeout spent sending, a client must read at least this rate or the session is closed
+#define MIN_TRANSFER_BYTES_PER_SECOND 1024
+// environment variable limiting the data a session keeps queued unsent in the kernel (TCP_NOTSENT_LOWAT),
+// unset leaves the send buffer to autotuning
+#define SESSION_UNSENT_BYTES_ENV "FTP_SESSION_UNSENT_BYTES"
+// keepalive probes detect peers that vanished without closing the connection, once a peer has not
+// answered for the transfer timeout (TCP_USER_TIMEOUT) it is dropped, so no probe count is set
+#define KEEPALIVE_IDLE_SECONDS 30
+#define KEEPALIVE_INTERVAL_SECONDS 10
+// audit log written by the listening process, rotated once it grows beyond the size limit
+#define AUDIT_LOG_FILE "ftp_audit.log"
+#define AUDIT_LOG_MAX_BYTES (10 * 1024 * 1024)
+#define AUDIT_LOG_MAX_FILES 5
+// sessions that can be audited at once, unless set with the environment variable, and records buffered for each of them
+#define AUDIT_SESSION_SLOTS 256
+#define AUDIT_SESSIONS_ENV "FTP_AUDIT_SESSIONS"
+#define AUDIT_RING_RECORDS 256
+// records written with a single writev and the size of one formatted record
+#define AUDIT_WRITE_BATCH 64
+#define AUDIT_LINE_BYTES 1024
+
+// audit record of one command, kept binary until the writer thread formats it
+struct auditRecord
+{
+  struct timespec timestamp;
+  uint64_t bytes;
+  uint64_t durationNs;
+  int replyCode;
+  char verb[8];
+  char path[128];
+};
+
+// session that got no audit ring, reported by the writer thread so that it is not silently missing from the log
+struct unauditedSession
+{
+  struct timespec timestamp;
+  uint64_t sessionId;
+  pid_t sessionPid;
+};
+
+// ring of one session in shared memory, filled by the session child and drained by the writer thread
+struct auditSlot
+{
+  atomic_int inUse;
+  atomic_int sessionPid;
+  uint64_t sessionId;
+  atomic_uint_fast64_t head;
+  atomic_uint_fast64_t tail;
+  atomic_uint_fast64_t dropped;
+  atomic_int sessionFinished;
+  struct auditRecord records[AUDIT_RING_RECORDS];
+};
+
+// TLS context shared by every child (holds certificate and session ticket keys)
+SSL_CTX *ftpTlsContext = NULL;
+// TLS session of the client served by this child, NULL while the connection is plaintext
+SSL *ftpSessionTls = NULL;
+// set on SIGHUP to start a new server on the same listening socket and drain this one
+volatile sig_atomic_t reloadRequested = 0;
+// absolute path of the server binary, resolved at startup so a reload works whatever PATH and working directory were used
+char serverBinaryPath[PATH_MAX];
+// audit rings of every session, shared between the listening process and its children
+struct auditSlot *auditSlots = NULL;
+int auditSlotCount = AUDIT_SESSION_SLOTS;
+// sessions without an audit ring, queued by the accept loop for the writer thread, and those not even queued
+struct unauditedSession unauditedSessions[AUDIT_RING_RECORDS];
+atomic_uint_fast64_t unauditedHead, unauditedTail, unauditedDropped;
+// audit ring of the session served by this child, NULL when auditing is unavailable
+struct auditSlot *sessionAuditSlot = NULL;
+// background writer draining the audit rings
+pthread_t auditWriterThread;
+atomic_int auditWriterStop;
+int auditLogFileDesc = -1;
+// reply code and transferred bytes of the command being run, recorded in the audit log
+int lastReplyCode = 0;
+uint64_t lastTransferBytes = 0;
+// set when a send to the client failed or timed out, the session is closed after the command
+bool sessionFailed = false;
+// time spent blocked in sends and bytes sent since the last transfer rate check
+int64_t rateWindowNs = 0;
+uint64_t rateWindowBytes = 0;
 
 int main(int argc, char *argv[])
 {
@@ -54,18 +185,21 @@ int main(int argc, char *argv[])
   struct sockaddr_in addressData;
   socklen_t ftpServerSocketSize;
   pid_t serverChildProcessId;
+  ssize_t serverBinaryPathLength = readlink("/proc/self/exe", serverBinaryPath, sizeof(serverBinaryPath) - 1);
+  serverBinaryPath[serverBinaryPathLength > 0 ? serverBinaryPathLength : 0] = '\0';
+  uint64_t sessionCounter = 0;
 
   // Check conditions to make sure the client will start the server with required arguments
-  if (argc != 3)
+  if (argc != 3 && argc != 7)
   {
-    printf("Invalid command format. Please type in following format - %s [<./server> -d <HomeDirectory>]\n", argv[0]);
+    printf("Invalid command format. Please type in following format - %s [<./server> -d <HomeDirectory> [-c <CertFile> -k <KeyFile>]]\n", argv[0]);
     exit(1);
   }
 
   // If 2nd arg is '-d' then server home directory will be 3rd arg
   if (strcmp(argv[1], "-d") != 0)
   {
-    printf("Invalid command format. Please type in following format - %s [<./server> -d <HomeDirectory>]\n", argv[0]);
+    printf("Invalid command format. Please type in following format - %s [<./server> -d <HomeDirectory> [-c <CertFile> -k <KeyFile>]]\n", argv[0]);
     exit(1);
   }
   else
@@ -74,61 +208,177 @@ int main(int argc, char *argv[])
     serverHomeDirectory = argv[2];
   }
 
-  // create the socket connection
-  serverSocketFileDesc = socket(AF_INET, SOCK_STREAM, 0);
-
-  // check for socket connection status and return respective messages
-  if (serverSocketFileDesc >= 0)
+  // If certificate and key are passed then enable AUTH TLS
+  if (argc == 7)
   {
-    printf("Server socket connection is success...:)\n");
+    if (strcmp(argv[3], "-c") != 0 || strcmp(argv[5], "-k") != 0)
+    {
+      printf("Invalid command format. Please type in following format - %s [<./server> -d <HomeDirectory> [-c <CertFile> -k <KeyFile>]]\n", argv[0]);
+      exit(1);
+    }
+    ftpTlsContext = createTlsContext(argv[4], argv[6]);
+    if (ftpTlsContext == NULL)
+    {
+      printf("Failed to load TLS certificate %s and key %s...:(\n", argv[4], argv[6]);
+      ERR_print_errors_fp(stderr);
+      exit(1);
+    }
+    printf("AUTH TLS is enabled...:)\n");
   }
-  else
+
+  // a reloading server passes its session ticket keys so tickets issued before the reload still resume
+  char *inheritedTicketKeys = getenv(TICKET_KEYS_FD_ENV);
+  if (inheritedTicketKeys != NULL)
   {
-    printf("Unable to create connection...:(\n");
-    exit(1);
+    unsigned char ticketKeys[TICKET_KEYS_BYTES];
+    int ticketKeysFileDesc = atoi(inheritedTicketKeys);
+    if (ftpTlsContext != NULL && read(ticketKeysFileDesc, ticketKeys, sizeof(ticketKeys)) == sizeof(ticketKeys))
+    {
+      SSL_CTX_set_tlsext_ticket_keys(ftpTlsContext, ticketKeys, sizeof(ticketKeys));
+      printf("Inherited session ticket keys from previous server...:)\n");
+    }
+    OPENSSL_cleanse(ticketKeys, sizeof(ticketKeys));
+    close(ticketKeysFileDesc);
+    unsetenv(TICKET_KEYS_FD_ENV);
   }
 
-  // clear the ftpServerAddress memory before the initialization
-  memset(&ftpServerAddress, '\0', sizeof(ftpServerAddress));
-  ftpServerAddress.sin_family = AF_INET;
-  ftpServerAddress.sin_port = htons(PORT);
-  ftpServerAddress.sin_addr.s_addr = inet_addr("127.0.0.1");
-
-  // using the address data bind to the socket
-  int serverBindStatus = bind(serverSocketFileDesc, (struct sockaddr *)&ftpServerAddress, sizeof(ftpServerAddress));
-  // if binding is success
-  if (serverBindStatus >= 0)
+  // a reloading server passes its listening socket, so skip creating and binding a new one
+  char *inheritedSocket = getenv(LISTEN_FD_ENV);
+  if (inheritedSocket != NULL)
   {
-    printf("Sucessfully binded to %d port...:)\n", PORT);
+    serverSocketFileDesc = atoi(inheritedSocket);
+    unsetenv(LISTEN_FD_ENV);
+    printf("Inherited listening socket on %d port from previous server...:)\n", PORT);
   }
-  // display failed to bind error message
   else
   {
-    printf("Failed to bind to %d port...:(\n", PORT);
-    exit(1);
+    // create the socket connection
+    serverSocketFileDesc = socket(AF_INET, SOCK_STREAM, 0);
+
+    // check for socket connection status and return respective messages
+    if (serverSocketFileDesc >= 0)
+    {
+      printf("Server socket connection is success...:)\n");
+    }
+    else
+    {
+      printf("Unable to create connection...:(\n");
+      exit(1);
+    }
+
+    // clear the ftpServerAddress memory before the initialization
+    memset(&ftpServerAddress, '\0', sizeof(ftpServerAddress));
+    ftpServerAddress.sin_family = AF_INET;
+    ftpServerAddress.sin_port = htons(PORT);
+    ftpServerAddress.sin_addr.s_addr = inet_addr("127.0.0.1");
+
+    // allow binding again while connections of a previous run are still in TIME_WAIT
+    int reuseAddress = 1;
+    setsockopt(serverSocketFileDesc, SOL_SOCKET, SO_REUSEADDR, &reuseAddress, sizeof(reuseAddress));
+    // using the address data bind to the socket
+    int serverBindStatus = bind(serverSocketFileDesc, (struct sockaddr *)&ftpServerAddress, sizeof(ftpServerAddress));
+    // if binding is success
+    if (serverBindStatus >= 0)
+    {
+      printf("Sucessfully binded to %d port...:)\n", PORT);
+    }
+    // display failed to bind error message
+    else
+    {
+      printf("Failed to bind to %d port...:(\n", PORT);
+      exit(1);
+    }
+
+    // start listening on the socket connection
+    int listenStatus = listen(serverSocketFileDesc, LISTEN_BACKLOG);
+    // If failed to listen
+    if (listenStatus != 0)
+    {
+      printf("Failed to bind to %d port...:(\n", PORT);
+      exit(1);
+    }
+    // On successful listening
+    else
+    {
+      printf("Server is listening on %d port!\n", PORT);
+    }
   }
 
-  // start listening on the socket connection
-  int listenStatus = listen(serverSocketFileDesc, 10);
-  // If failed to listen
-  if (listenStatus != 0)
+  // SIGHUP and SIGCHLD are only delivered while waiting for a connection so they never interrupt an accept
+  struct sigaction reloadAction, childExitAction;
+  sigset_t reloadMask, waitMask;
+  memset(&reloadAction, '\0', sizeof(reloadAction));
+  reloadAction.sa_handler = reloadSignalHandler;
+  sigaction(SIGHUP, &reloadAction, NULL);
+  memset(&childExitAction, '\0', sizeof(childExitAction));
+  childExitAction.sa_handler = childExitSignalHandler;
+  sigaction(SIGCHLD, &childExitAction, NULL);
+  sigemptyset(&reloadMask);
+  sigaddset(&reloadMask, SIGHUP);
+  sigaddset(&reloadMask, SIGCHLD);
+  sigprocmask(SIG_BLOCK, &reloadMask, &waitMask);
+  // the listening socket, and the readiness pipe of a new server while a reload is in progress
+  struct pollfd listeningPoll[2] = {{.fd = serverSocketFileDesc, .events = POLLIN}, {.fd = -1, .events = POLLIN}};
+
+  // started after blocking the signals so that the writer thread never receives them
+  if (startAuditLog() == -1)
   {
-    printf("Failed to bind to %d port...:(\n", PORT);
-    exit(1);
+    printf("Failed to open audit log %s, continuing without auditing...:(\n", AUDIT_LOG_FILE);
   }
-  // On successful listening
-  else
+
+  // tell the previous server that this one is accepting, so it can stop and drain its sessions
+  char *readyPipe = getenv(READY_FD_ENV);
+  if (readyPipe != NULL)
   {
-    printf("Server is listening on %d port!\n", PORT);
+    write(atoi(readyPipe), "1", 1);
+    close(atoi(readyPipe));
+    unsetenv(READY_FD_ENV);
   }
 
   // start accepting client connections
   while (1)
   {
+    // wait for a connection, a finished session or a reload request
+    if (ppoll(listeningPoll, 2, NULL, &waitMask) == -1 && errno != EINTR)
+    {
+      exit(1);
+    }
+    reapSessionChildren();
+    // the new server reported ready, or exited before it was, in which case this one keeps serving
+    if (listeningPoll[1].fd != -1 && listeningPoll[1].revents != 0)
+    {
+      char newServerReady;
+      if (read(listeningPoll[1].fd, &newServerReady, 1) == 1)
+      {
+        drainSessionsAndExit(serverSocketFileDesc);
+      }
+      printf("New server %s exited before accepting connections, continuing to serve...:(\n", serverBinaryPath);
+      close(listeningPoll[1].fd);
+      listeningPoll[1].fd = -1;
+    }
+    if (reloadRequested)
+    {
+      reloadRequested = 0;
+      // this server keeps accepting until the new one is ready
+      if (listeningPoll[1].fd == -1)
+      {
+        listeningPoll[1].fd = startNewServer(serverSocketFileDesc, argv);
+      }
+    }
+    if (!(listeningPoll[0].revents & POLLIN))
+    {
+      continue;
+    }
     // accept the client connection
+    ftpServerSocketSize = sizeof(addressData);
     ftpServerSocket = accept(serverSocketFileDesc, (struct sockaddr *)&addressData, &ftpServerSocketSize);
+    // a client that reset the connection before it was accepted is not a server failure
+    if (ftpServerSocket <= -1 && (errno == ECONNABORTED || errno == EINTR))
+    {
+      continue;
+    }
     // on failure to accept the connection
-    if (ftpServerSocket <= -1)
+    else if (ftpServerSocket <= -1)
     {
       exit(1);
     }
@@ -137,29 +387,74 @@ int main(int argc, char *argv[])
     {
       printf("Connection successfully accepted from Port: %d.\n", ntohs(addressData.sin_port));
     }
+    // reserve the audit ring before forking so the child can log right away
+    sessionAuditSlot = acquireAuditSlot(++sessionCounter);
+    // flush first so the child does not print the buffered output again when it exits
+    fflush(stdout);
     // create a child process to run the FTP commands
     if ((serverChildProcessId = fork()) == 0)
     {
       // close the previous socket file descriptor
       close(serverSocketFileDesc);
+      if (listeningPoll[1].fd != -1)
+      {
+        close(listeningPoll[1].fd);
+      }
+      // sessions keep running across a reload, so they ignore it
+      signal(SIGHUP, SIG_IGN);
+      sigprocmask(SIG_SETMASK, &waitMask, NULL);
+      // a client that went away is reported by send failing instead of killing the session
+      signal(SIGPIPE, SIG_IGN);
+      configureSessionSocket(ftpServerSocket);
       // initlaize user logged varibale to false
       int userLogged = 0;
       // run the FTP commands in a loop
       while (1)
       {
-        int recieveStatus = recv(ftpServerSocket, buffer, 1024, 0);
+        errno = 0;
+        int recieveStatus = receiveDataFromClient(ftpServerSocket, buffer, 1024);
+        // the client disconnected, the connection failed or no command came within the idle timeout
+        if (recieveStatus <= 0)
+        {
+          if (errno == EAGAIN || errno == EWOULDBLOCK)
+          {
+            printf("Closing idle client connection from Port: %d.\n", ntohs(addressData.sin_port));
+            strcpy(buffer, "Code[421]: Idle timeout, closing connection...:(");
+            sentDataToClient(ftpServerSocket, buffer);
+          }
+          else
+          {
+            printf("Client connection from Port: %d was lost.\n", ntohs(addressData.sin_port));
+          }
+          break;
+        }
+        // keep the command for the audit log as the handlers overwrite the buffer
+        char auditedCommand[sizeof(buffer)];
+        struct timespec commandStartTime;
+        clock_gettime(CLOCK_MONOTONIC, &commandStartTime);
+        snprintf(auditedCommand, sizeof(auditedCommand), "%.*s", (int)strcspn(buffer, "\r\n"), buffer);
+        lastReplyCode = 0;
+        lastTransferBytes = 0;
         // check for FTP QUIT/quit and ABOR/abor command
         if (strncmp(buffer, "QUIT", 4) == 0 || strncmp(buffer, "quit", 4) == 0 || strncmp(buffer, "ABOR", 4) == 0 || strncmp(buffer, "abor", 4) == 0)
         {
+          closeTlsSession();
           quitCommand(addressData);
+          lastReplyCode = 221;
+          auditCommand(auditedCommand, &commandStartTime);
           break;
         }
         else
         {
           // clear the newline terminator from buffer
           buffer[strcspn(buffer, "\n")] = 0;
+          // If ftp command is AUTH TLS/auth tls, allowed before login
+          if (strncmp(buffer, "AUTH TLS", 8) == 0 || strncmp(buffer, "auth tls", 8) == 0)
+          {
+            authTlsCommand(ftpServerSocket, buffer);
+          }
           // check for used logged or not and throw error message
-          if (userLogged == 0 && !(strncmp(buffer, "USER", 4) == 0 || strncmp(buffer, "user", 4) == 0))
+          else if (userLogged == 0 && !(strncmp(buffer, "USER", 4) == 0 || strncmp(buffer, "user", 4) == 0))
           {
             userNotLogged(ftpServerSocket, buffer);
           }
@@ -210,11 +505,38 @@ int main(int argc, char *argv[])
           {
             invalidCommand(ftpServerSocket, buffer);
           }
+          auditCommand(auditedCommand, &commandStartTime);
+          // stop serving a client that can not be written to
+          if (sessionFailed)
+          {
+            printf("Closing client connection from Port: %d, sending failed or timed out.\n", ntohs(addressData.sin_port));
+            break;
+          }
           // clear the buffer memory
           bzero(buffer, sizeof(buffer));
           resetBufferMemory(buffer);
         }
       }
+      // the session is over, do not fall back into the accept loop
+      close(ftpServerSocket);
+      exit(0);
+    }
+    // the child owns the client connection from here on
+    close(ftpServerSocket);
+    // the writer thread frees the audit ring once this pid has exited
+    if (sessionAuditSlot != NULL && serverChildProcessId > 0)
+    {
+      atomic_store(&sessionAuditSlot->sessionPid, serverChildProcessId);
+    }
+    // release it right away when fork failed
+    else if (sessionAuditSlot != NULL)
+    {
+      atomic_store(&sessionAuditSlot->inUse, 0);
+    }
+    // every audit ring is busy, record that the session ran without auditing
+    else if (serverChildProcessId > 0)
+    {
+      reportUnauditedSession(sessionCounter, serverChildProcessId);
     }
   }
   // close the socket
@@ -222,6 +544,478 @@ int main(int argc, char *argv[])
   return 0;
 }
 
+/**
+ * @brief This method will be invoked on SIGHUP to request a graceful reload.
+ *
+ * @param signalNumber
+ */
+void reloadSignalHandler(int signalNumber)
+{
+  reloadRequested = 1;
+}
+
+/**
+ * @brief This method will be invoked on SIGCHLD, only to wake up the accept loop to reap the session.
+ *
+ * @param signalNumber
+ */
+void childExitSignalHandler(int signalNumber)
+{
+}
+
+/**
+ * @brief This method will reap every finished session child, whether or not it has an audit ring.
+ *
+ */
+void reapSessionChildren(void)
+{
+  pid_t sessionPid;
+  while ((sessionPid = waitpid(-1, NULL, WNOHANG)) > 0)
+  {
+    finishAuditSession(sessionPid);
+  }
+}
+
+/**
+ * @brief This method will start the new server binary on the same listening socket.
+ * The new server writes to the returned pipe once it is accepting connections, the pipe is
+ * closed without data when it could not be started or exited before that.
+ *
+ * @param serverSocketFileDesc
+ * @param argv
+ * @return read end of the readiness pipe, -1 when the reload could not be started
+ */
+int startNewServer(int serverSocketFileDesc, char *argv[])
+{
+  char socketFileDesc[16], readyFileDesc[16], ticketKeysFileDesc[16];
+  int readyPipe[2];
+  pid_t reloadProcessId;
+  // do not let the new server repeat buffered output
+  fflush(stdout);
+  if (pipe2(readyPipe, O_CLOEXEC) == -1)
+  {
+    printf("Failed to reload the server...:(\n");
+    return -1;
+  }
+  if ((reloadProcessId = fork()) == -1)
+  {
+    printf("Failed to reload the server...:(\n");
+    close(readyPipe[0]);
+    close(readyPipe[1]);
+    return -1;
+  }
+  if (reloadProcessId == 0)
+  {
+    // fork again so the new server is not one of the sessions waited on when draining
+    if (fork() == 0)
+    {
+      sigset_t emptyMask;
+      sigemptyset(&emptyMask);
+      sigprocmask(SIG_SETMASK, &emptyMask, NULL);
+      signal(SIGHUP, SIG_DFL);
+      // only the write end of the readiness pipe is passed on to the new server
+      fcntl(readyPipe[1], F_SETFD, 0);
+      sprintf(socketFileDesc, "%d", serverSocketFileDesc);
+      sprintf(readyFileDesc, "%d", readyPipe[1]);
+      setenv(LISTEN_FD_ENV, socketFileDesc, 1);
+      setenv(READY_FD_ENV, readyFileDesc, 1);
+      // pass the session ticket keys through a pipe, keeping them out of the environment
+      int ticketKeysPipe[2];
+      unsigned char ticketKeys[TICKET_KEYS_BYTES];
+      if (ftpTlsContext != NULL && SSL_CTX_get_tlsext_ticket_keys(ftpTlsContext, ticketKeys, sizeof(ticketKeys)) == 1 && pipe(ticketKeysPipe) == 0)
+      {
+        write(ticketKeysPipe[1], ticketKeys, sizeof(ticketKeys));
+        close(ticketKeysPipe[1]);
+        sprintf(ticketKeysFileDesc, "%d", ticketKeysPipe[0]);
+        setenv(TICKET_KEYS_FD_ENV, ticketKeysFileDesc, 1);
+      }
+      OPENSSL_cleanse(ticketKeys, sizeof(ticketKeys));
+      // start the binary now deployed at the startup path, or this binary when that path is gone
+      execv(serverBinaryPath, argv);
+      execv("/proc/self/exe", argv);
+    }
+    _exit(0);
+  }
+  close(readyPipe[1]);
+  waitpid(reloadProcessId, NULL, 0);
+  printf("Started new server %s, accepting until it is ready...\n", serverBinaryPath);
+  return readyPipe[0];
+}
+
+/**
+ * @brief This method will stop accepting once the new server is ready, wait for the active sessions to finish and exit.
+ * Connections queued on the socket are accepted by the new server, so clients are never refused.
+ *
+ * @param serverSocketFileDesc
+ */
+void drainSessionsAndExit(int serverSocketFileDesc)
+{
+  close(serverSocketFileDesc);
+  printf("New server is accepting connections, waiting for active sessions...\n");
+  pid_t sessionPid;
+  while ((sessionPid = wait(NULL)) > 0 || errno == EINTR)
+  {
+    finishAuditSession(sessionPid);
+  }
+  printf("All sessions finished, exiting...\n");
+  stopAuditLog();
+  exit(0);
+}
+
+/**
+ * @brief This method will map the shared audit rings, open the audit log and start the writer thread.
+ *
+ * @return 0 on success and -1 on failure
+ */
+int startAuditLog(void)
+{
+  char *auditSessions = getenv(AUDIT_SESSIONS_ENV);
+  if (auditSessions != NULL && atoi(auditSessions) > 0)
+  {
+    auditSlotCount = atoi(auditSessions);
+  }
+  auditSlots = mmap(NULL, sizeof(struct auditSlot) * auditSlotCount, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (auditSlots == MAP_FAILED)
+  {
+    auditSlots = NULL;
+    return -1;
+  }
+  auditLogFileDesc = open(AUDIT_LOG_FILE, O_CREAT | O_WRONLY | O_APPEND | O_CLOEXEC, 0644);
+  if (auditLogFileDesc == -1 || pthread_create(&auditWriterThread, NULL, auditWriterLoop, NULL) != 0)
+  {
+    munmap(auditSlots, sizeof(struct auditSlot) * auditSlotCount);
+    auditSlots = NULL;
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * @brief This method will stop the writer thread once every audit ring is drained.
+ *
+ */
+void stopAuditLog(void)
+{
+  if (auditSlots == NULL)
+  {
+    return;
+  }
+  atomic_store(&auditWriterStop, 1);
+  pthread_join(auditWriterThread, NULL);
+  close(auditLogFileDesc);
+}
+
+/**
+ * @brief This method will reserve a free audit ring for a new session.
+ *
+ * @param sessionId
+ * @return audit ring or NULL when auditing is unavailable or every ring is busy
+ */
+struct auditSlot *acquireAuditSlot(uint64_t sessionId)
+{
+  for (int slotIndex = 0; auditSlots != NULL && slotIndex < auditSlotCount; slotIndex++)
+  {
+    struct auditSlot *slot = &auditSlots[slotIndex];
+    if (atomic_load(&slot->inUse) == 0)
+    {
+      slot->sessionId = sessionId;
+      atomic_store(&slot->sessionPid, 0);
+      atomic_store(&slot->head, 0);
+      atomic_store(&slot->tail, 0);
+      atomic_store(&slot->dropped, 0);
+      atomic_store(&slot->sessionFinished, 0);
+      atomic_store(&slot->inUse, 1);
+      return slot;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * @brief This method will mark the audit ring of an exited session, so the writer thread releases it once drained.
+ *
+ * @param sessionPid
+ */
+void finishAuditSession(pid_t sessionPid)
+{
+  for (int slotIndex = 0; auditSlots != NULL && slotIndex < auditSlotCount; slotIndex++)
+  {
+    if (atomic_load(&auditSlots[slotIndex].inUse) == 1 && atomic_load(&auditSlots[slotIndex].sessionPid) == sessionPid)
+    {
+      atomic_store(&auditSlots[slotIndex].sessionFinished, 1);
+    }
+  }
+}
+
+/**
+ * @brief This method will queue a session that got no audit ring, for the writer thread to log it as unaudited.
+ *
+ * @param sessionId
+ * @param sessionPid
+ */
+void reportUnauditedSession(uint64_t sessionId, pid_t sessionPid)
+{
+  if (auditSlots == NULL)
+  {
+    return;
+  }
+  uint64_t head = atomic_load_explicit(&unauditedHead, memory_order_relaxed);
+  if (head - atomic_load_explicit(&unauditedTail, memory_order_acquire) >= AUDIT_RING_RECORDS)
+  {
+    atomic_fetch_add_explicit(&unauditedDropped, 1, memory_order_relaxed);
+    return;
+  }
+  struct unauditedSession *session = &unauditedSessions[head % AUDIT_RING_RECORDS];
+  clock_gettime(CLOCK_REALTIME, &session->timestamp);
+  session->sessionId = sessionId;
+  session->sessionPid = sessionPid;
+  atomic_store_explicit(&unauditedHead, head + 1, memory_order_release);
+}
+
+/**
+ * @brief This method will push the audit record of a command into the session ring.
+ * It makes no system call and never blocks, the record is dropped when the ring is full.
+ *
+ * @param command
+ * @param startTime
+ */
+void auditCommand(char *command, struct timespec *startTime)
+{
+  struct timespec endTime;
+  if (sessionAuditSlot == NULL)
+  {
+    return;
+  }
+  uint64_t head = atomic_load_explicit(&sessionAuditSlot->head, memory_order_relaxed);
+  if (head - atomic_load_explicit(&sessionAuditSlot->tail, memory_order_acquire) >= AUDIT_RING_RECORDS)
+  {
+    atomic_fetch_add_explicit(&sessionAuditSlot->dropped, 1, memory_order_relaxed);
+    return;
+  }
+  struct auditRecord *record = &sessionAuditSlot->records[head % AUDIT_RING_RECORDS];
+  clock_gettime(CLOCK_MONOTONIC, &endTime);
+  clock_gettime(CLOCK_REALTIME, &record->timestamp);
+  record->durationNs = (endTime.tv_sec - startTime->tv_sec) * 1000000000ULL + endTime.tv_nsec - startTime->tv_nsec;
+  record->bytes = lastTransferBytes;
+  record->replyCode = lastReplyCode;
+  // split the command into the verb and its argument
+  size_t verbLength = strcspn(command, " ");
+  snprintf(record->verb, sizeof(record->verb), "%.*s", (int)verbLength, command);
+  snprintf(record->path, sizeof(record->path), "%s", command[verbLength] == ' ' ? command + verbLength + 1 : "");
+  atomic_store_explicit(&sessionAuditSlot->head, head + 1, memory_order_release);
+}
+
+/**
+ * @brief This method will check that the audit log file descriptor still refers to the file at the log path.
+ *
+ * @return true when the log was not rotated by another server process
+ */
+bool auditLogIsCurrent(void)
+{
+  struct stat pathStatus, fileStatus;
+  return stat(AUDIT_LOG_FILE, &pathStatus) == 0 && fstat(auditLogFileDesc, &fileStatus) == 0 && pathStatus.st_ino == fileStatus.st_ino && pathStatus.st_dev == fileStatus.st_dev;
+}
+
+/**
+ * @brief This method will reopen the audit log at the log path.
+ *
+ */
+void reopenAuditLog(void)
+{
+  close(auditLogFileDesc);
+  auditLogFileDesc = open(AUDIT_LOG_FILE, O_CREAT | O_WRONLY | O_APPEND | O_CLOEXEC, 0644);
+}
+
+/**
+ * @brief This method will rename the audit log to <name>.1, shifting the older ones, and reopen it.
+ *
+ */
+void rotateAuditLog(void)
+{
+  char olderFile[256], newerFile[256];
+  for (int fileIndex = AUDIT_LOG_MAX_FILES - 1; fileIndex >= 1; fileIndex--)
+  {
+    sprintf(newerFile, "%s.%d", AUDIT_LOG_FILE, fileIndex);
+    sprintf(olderFile, "%s.%d", AUDIT_LOG_FILE, fileIndex + 1);
+    rename(newerFile, olderFile);
+  }
+  sprintf(newerFile, "%s.1", AUDIT_LOG_FILE);
+  rename(AUDIT_LOG_FILE, newerFile);
+  reopenAuditLog();
+}
+
+/**
+ * @brief This method will write the formatted audit lines with a single writev, rotating the log when it is full.
+ * A reloading and a new server share the log, so it is reopened when the other one rotated it and
+ * rotated under a lock so that only one of them does it.
+ *
+ * @param auditLines
+ * @param lineCount
+ */
+void writeAuditLines(char auditLines[][AUDIT_LINE_BYTES], int lineCount)
+{
+  struct iovec lineVectors[AUDIT_WRITE_BATCH];
+  struct stat logStatus;
+  if (lineCount == 0)
+  {
+    return;
+  }
+  if (!auditLogIsCurrent())
+  {
+    reopenAuditLog();
+  }
+  if (fstat(auditLogFileDesc, &logStatus) == 0 && logStatus.st_size >= AUDIT_LOG_MAX_BYTES)
+  {
+    // the lock is released when the rotated file is closed
+    flock(auditLogFileDesc, LOCK_EX);
+    if (auditLogIsCurrent())
+    {
+      rotateAuditLog();
+    }
+    else
+    {
+      reopenAuditLog();
+    }
+  }
+  for (int lineIndex = 0; lineIndex < lineCount; lineIndex++)
+  {
+    lineVectors[lineIndex].iov_base = auditLines[lineIndex];
+    lineVectors[lineIndex].iov_len = strlen(auditLines[lineIndex]);
+  }
+  writev(auditLogFileDesc, lineVectors, lineCount);
+}
+
+/**
+ * @brief This method will copy a client supplied field into the audit line, escaping quotes, backslashes
+ * and control characters so that it can not forge other fields or lines.
+ *
+ * @param escapedField
+ * @param size
+ * @param field
+ */
+void escapeAuditField(char *escapedField, size_t size, const char *field)
+{
+  size_t length = 0;
+  for (; *field != '\0' && length + 5 < size; field++)
+  {
+    unsigned char character = *field;
+    if (character == '"' || character == '\\')
+    {
+      escapedField[length++] = '\\';
+      escapedField[length++] = character;
+    }
+    else if (character < 0x20 || character == 0x7f)
+    {
+      length += sprintf(escapedField + length, "\\x%02x", character);
+    }
+    else
+    {
+      escapedField[length++] = character;
+    }
+  }
+  escapedField[length] = '\0';
+}
+
+/**
+ * @brief This method will run in the writer thread, formatting the records of every ring into the audit log.
+ * A ring is released once its session has exited and everything it logged is written.
+ *
+ * @param argument
+ * @return NULL
+ */
+void *auditWriterLoop(void *argument)
+{
+  static char auditLines[AUDIT_WRITE_BATCH][AUDIT_LINE_BYTES];
+  // session ids restart in every server process, so they are prefixed with its pid to stay unique across reloads
+  pid_t listenerPid = getpid();
+  int lineCount = 0;
+  while (1)
+  {
+    int stopping = atomic_load(&auditWriterStop);
+    uint64_t writtenRecords = 0;
+    for (int slotIndex = 0; slotIndex < auditSlotCount; slotIndex++)
+    {
+      struct auditSlot *slot = &auditSlots[slotIndex];
+      if (atomic_load(&slot->inUse) == 0)
+      {
+        continue;
+      }
+      // check for exit before draining so the last records of the session are not missed
+      pid_t sessionPid = atomic_load(&slot->sessionPid);
+      bool sessionFinished = atomic_load(&slot->sessionFinished) == 1;
+      uint64_t tail = atomic_load_explicit(&slot->tail, memory_order_relaxed);
+      uint64_t head = atomic_load_explicit(&slot->head, memory_order_acquire);
+      for (; tail != head; tail++, writtenRecords++)
+      {
+        struct auditRecord *record = &slot->records[tail % AUDIT_RING_RECORDS];
+        struct tm recordTime;
+        char timeText[32], verb[4 * sizeof(record->verb)], path[4 * sizeof(record->path)];
+        escapeAuditField(verb, sizeof(verb), record->verb);
+        escapeAuditField(path, sizeof(path), record->path);
+        gmtime_r(&record->timestamp.tv_sec, &recordTime);
+        strftime(timeText, sizeof(timeText), "%Y-%m-%dT%H:%M:%S", &recordTime);
+        snprintf(auditLines[lineCount++], sizeof(auditLines[0]), "%s.%06ldZ session=%d-%llu pid=%d verb=%s path=\"%s\" bytes=%llu duration_us=%llu code=%d\n", timeText, record->timestamp.tv_nsec / 1000, listenerPid, (unsigned long long)slot->sessionId, sessionPid, verb, path, (unsigned long long)record->bytes, (unsigned long long)(record->durationNs / 1000), record->replyCode);
+        if (lineCount == AUDIT_WRITE_BATCH)
+        {
+          writeAuditLines(auditLines, lineCount);
+          lineCount = 0;
+        }
+        // hand the record back to the session
+        atomic_store_explicit(&slot->tail, tail + 1, memory_order_release);
+      }
+      if (sessionFinished)
+      {
+        uint64_t droppedRecords = atomic_load(&slot->dropped);
+        if (droppedRecords > 0)
+        {
+          snprintf(auditLines[lineCount++], sizeof(auditLines[0]), "session=%d-%llu dropped=%llu\n", listenerPid, (unsigned long long)slot->sessionId, (unsigned long long)droppedRecords);
+          if (lineCount == AUDIT_WRITE_BATCH)
+          {
+            writeAuditLines(auditLines, lineCount);
+            lineCount = 0;
+          }
+        }
+        atomic_store(&slot->inUse, 0);
+      }
+    }
+    // sessions that started while every ring was busy
+    uint64_t unauditedTailIndex = atomic_load_explicit(&unauditedTail, memory_order_relaxed);
+    uint64_t unauditedHeadIndex = atomic_load_explicit(&unauditedHead, memory_order_acquire);
+    for (; unauditedTailIndex != unauditedHeadIndex; unauditedTailIndex++, writtenRecords++)
+    {
+      struct unauditedSession *session = &unauditedSessions[unauditedTailIndex % AUDIT_RING_RECORDS];
+      struct tm sessionTime;
+      char timeText[32];
+      gmtime_r(&session->timestamp.tv_sec, &sessionTime);
+      strftime(timeText, sizeof(timeText), "%Y-%m-%dT%H:%M:%S", &sessionTime);
+      snprintf(auditLines[lineCount++], sizeof(auditLines[0]), "%s.%06ldZ session=%d-%llu pid=%d unaudited\n", timeText, session->timestamp.tv_nsec / 1000, listenerPid, (unsigned long long)session->sessionId, session->sessionPid);
+      if (lineCount == AUDIT_WRITE_BATCH)
+      {
+        writeAuditLines(auditLines, lineCount);
+        lineCount = 0;
+      }
+      atomic_store_explicit(&unauditedTail, unauditedTailIndex + 1, memory_order_release);
+    }
+    // and those that did not even fit in the queue
+    uint64_t unlistedSessions = atomic_exchange(&unauditedDropped, 0);
+    if (unlistedSessions > 0)
+    {
+      snprintf(auditLines[lineCount++], sizeof(auditLines[0]), "unaudited=%llu\n", (unsigned long long)unlistedSessions);
+    }
+    writeAuditLines(auditLines, lineCount);
+    lineCount = 0;
+    if (stopping && writtenRecords == 0)
+    {
+      return NULL;
+    }
+    // sleep only when idle so a busy server is drained continuously
+    if (writtenRecords == 0)
+    {
+      usleep(50000);
+    }
+  }
+}
+
 /**
  * @brief This method will send message to client on quit command.
  *
@@ -250,7 +1044,216 @@ void resetBufferMemory(char *buffer)
  */
 void sentDataToClient(int ftpServerSocket, char *buffer)
 {
-  send(ftpServerSocket, buffer, strlen(buffer), 0);
+  // remember the first reply code of the command for the audit log
+  char *replyCode = strcasestr(buffer, "Code[");
+  if (lastReplyCode == 0 && replyCode != NULL)
+  {
+    lastReplyCode = atoi(replyCode + 5);
+  }
+  sendToClient(ftpServerSocket, buffer, strlen(buffer));
+}
+
+/**
+ * @brief This method will send all the data to the client, through the TLS session after AUTH TLS.
+ * A send blocks while the kernel send buffer is full, which paces a slow reader, and fails after the transfer timeout
+ * or when the client reads slower than the minimum transfer rate.
+ *
+ * @param ftpServerSocket
+ * @param data
+ * @param length
+ * @return true when everything was sent
+ */
+bool sendToClient(int ftpServerSocket, char *data, size_t length)
+{
+  while (length > 0 && !sessionFailed)
+  {
+    ssize_t sentBytes;
+    struct timespec sendStartTime;
+    clock_gettime(CLOCK_MONOTONIC, &sendStartTime);
+    if (ftpSessionTls != NULL)
+    {
+      sentBytes = SSL_write(ftpSessionTls, data, length);
+    }
+    else
+    {
+      sentBytes = send(ftpServerSocket, data, length, 0);
+    }
+    if (sentBytes <= 0)
+    {
+      sessionFailed = true;
+    }
+    else if (checkTransferRate(&sendStartTime, sentBytes))
+    {
+      data += sentBytes;
+      length -= sentBytes;
+    }
+  }
+  return !sessionFailed;
+}
+
+/**
+ * @brief This method will add a send to the transfer rate of the session and fail the session when, over
+ * the last transfer timeout spent sending, the client read less than the minimum transfer rate.
+ * Only time blocked in sends counts, so waiting for commands or receiving uploads never fails it,
+ * while a client acknowledging a few bytes before each send timeout does.
+ *
+ * @param sendStartTime
+ * @param sentBytes
+ * @return false when the session failed
+ */
+bool checkTransferRate(struct timespec *sendStartTime, ssize_t sentBytes)
+{
+  struct timespec currentTime;
+  clock_gettime(CLOCK_MONOTONIC, &currentTime);
+  rateWindowNs += (int64_t)(currentTime.tv_sec - sendStartTime->tv_sec) * 1000000000 + (currentTime.tv_nsec - sendStartTime->tv_nsec);
+  rateWindowBytes += sentBytes > 0 ? sentBytes : 0;
+  if (rateWindowNs >= (int64_t)TRANSFER_TIMEOUT_SECONDS * 1000000000)
+  {
+    if (rateWindowBytes < (uint64_t)MIN_TRANSFER_BYTES_PER_SECOND * TRANSFER_TIMEOUT_SECONDS)
+    {
+      sessionFailed = true;
+    }
+    rateWindowNs = 0;
+    rateWindowBytes = 0;
+  }
+  return !sessionFailed;
+}
+
+/**
+ * @brief This method will set the timeouts and keepalive of a session connection.
+ *
+ * @param ftpServerSocket
+ */
+void configureSessionSocket(int ftpServerSocket)
+{
+  int enable = 1, keepAliveIdle = KEEPALIVE_IDLE_SECONDS, keepAliveInterval = KEEPALIVE_INTERVAL_SECONDS;
+  unsigned int unacknowledgedTimeout = TRANSFER_TIMEOUT_SECONDS * 1000;
+  struct timeval idleTimeout = {.tv_sec = IDLE_TIMEOUT_SECONDS};
+  struct timeval transferTimeout = {.tv_sec = TRANSFER_TIMEOUT_SECONDS};
+  setsockopt(ftpServerSocket, SOL_SOCKET, SO_KEEPALIVE, &enable, sizeof(enable));
+  setsockopt(ftpServerSocket, IPPROTO_TCP, TCP_KEEPIDLE, &keepAliveIdle, sizeof(keepAliveIdle));
+  setsockopt(ftpServerSocket, IPPROTO_TCP, TCP_KEEPINTVL, &keepAliveInterval, sizeof(keepAliveInterval));
+  // drop the connection when sent data or keepalive probes stay unacknowledged for the transfer timeout
+  setsockopt(ftpServerSocket, IPPROTO_TCP, TCP_USER_TIMEOUT, &unacknowledgedTimeout, sizeof(unacknowledgedTimeout));
+  // receiving a command waits for the idle timeout and sending waits for the transfer timeout
+  setsockopt(ftpServerSocket, SOL_SOCKET, SO_RCVTIMEO, &idleTimeout, sizeof(idleTimeout));
+  setsockopt(ftpServerSocket, SOL_SOCKET, SO_SNDTIMEO, &transferTimeout, sizeof(transferTimeout));
+  // optionally cap the unsent data queued for the client, bounding the kernel memory a slow reader holds
+  char *unsentBytesLimit = getenv(SESSION_UNSENT_BYTES_ENV);
+  if (unsentBytesLimit != NULL && atoi(unsentBytesLimit) > 0)
+  {
+    int unsentBytes = atoi(unsentBytesLimit);
+    setsockopt(ftpServerSocket, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &unsentBytes, sizeof(unsentBytes));
+  }
+}
+
+/**
+ * @brief This method will receive the command from the client, decrypting it when TLS is negotiated
+ *
+ * @param ftpServerSocket
+ * @param buffer
+ * @param size
+ * @return number of bytes received, 0 on disconnect and -1 on failure
+ */
+int receiveDataFromClient(int ftpServerSocket, char *buffer, int size)
+{
+  if (ftpSessionTls != NULL)
+  {
+    return SSL_read(ftpSessionTls, buffer, size);
+  }
+  return recv(ftpServerSocket, buffer, size, 0);
+}
+
+/**
+ * @brief This method will create the TLS context used for AUTH TLS.
+ * kTLS is requested so that the kernel encrypts records and RETR can keep using sendfile.
+ * Session tickets are used for resumption as the ticket keys live in this context and are
+ * inherited by every forked child, unlike the per-process session cache. A reload hands the
+ * keys to the new server, so tickets stay valid across it.
+ *
+ * @param certificateFile
+ * @param privateKeyFile
+ * @return TLS context or NULL on failure
+ */
+SSL_CTX *createTlsContext(char *certificateFile, char *privateKeyFile)
+{
+  SSL_CTX *tlsContext = SSL_CTX_new(TLS_server_method());
+  if (tlsContext == NULL)
+  {
+    return NULL;
+  }
+  SSL_CTX_set_min_proto_version(tlsContext, TLS1_2_VERSION);
+  if (getenv(DISABLE_KTLS_ENV) == NULL)
+  {
+    SSL_CTX_set_options(tlsContext, SSL_OP_ENABLE_KTLS);
+  }
+  // the session cache would be lost in each child, so only rely on stateless tickets
+  SSL_CTX_set_session_cache_mode(tlsContext, SSL_SESS_CACHE_OFF);
+  SSL_CTX_set_session_id_context(tlsContext, (const unsigned char *)"ftp", 3);
+  // load the certificate and the private key
+  if (SSL_CTX_use_certificate_chain_file(tlsContext, certificateFile) <= 0 || SSL_CTX_use_PrivateKey_file(tlsContext, privateKeyFile, SSL_FILETYPE_PEM) <= 0 || SSL_CTX_check_private_key(tlsContext) != 1)
+  {
+    SSL_CTX_free(tlsContext);
+    return NULL;
+  }
+  return tlsContext;
+}
+
+/**
+ * @brief This method will upgrade the control connection to TLS on auth tls command.
+ *
+ * @param ftpServerSocket
+ * @param buffer
+ */
+void authTlsCommand(int ftpServerSocket, char *buffer)
+{
+  resetBufferMemory(buffer);
+  // server started without certificate
+  if (ftpTlsContext == NULL)
+  {
+    strcpy(buffer, "Code[431]: TLS is not configured on server...:(");
+    sentDataToClient(ftpServerSocket, buffer);
+    return;
+  }
+  // TLS already negotiated on this connection
+  if (ftpSessionTls != NULL)
+  {
+    strcpy(buffer, "Code[503]: TLS is already negotiated...:(");
+    sentDataToClient(ftpServerSocket, buffer);
+    return;
+  }
+  // reply in plaintext and then start the handshake
+  strcpy(buffer, "Code[234]: Proceed with TLS negotiation...:)");
+  sentDataToClient(ftpServerSocket, buffer);
+  // the handshake, the session tickets and the next reply are separate writes, so do not let
+  // Nagle hold them back until the client sends its delayed ACK
+  int noDelay = 1;
+  setsockopt(ftpServerSocket, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+  ftpSessionTls = SSL_new(ftpTlsContext);
+  // the connection can not go back to plaintext after a failed handshake
+  if (ftpSessionTls == NULL || SSL_set_fd(ftpSessionTls, ftpServerSocket) != 1 || SSL_accept(ftpSessionTls) <= 0)
+  {
+    printf("TLS negotiation failed...:(\n");
+    ERR_print_errors_fp(stderr);
+    SSL_free(ftpSessionTls);
+    close(ftpServerSocket);
+    exit(1);
+  }
+  printf("TLS negotiated using %s%s, kernel TLS %s.\n", SSL_get_version(ftpSessionTls), SSL_session_reused(ftpSessionTls) ? " (resumed)" : "", BIO_get_ktls_send(SSL_get_wbio(ftpSessionTls)) ? "on" : "off");
+}
+
+/**
+ * @brief This method will shutdown the TLS session if one is negotiated.
+ *
+ */
+void closeTlsSession(void)
+{
+  if (ftpSessionTls != NULL)
+  {
+    SSL_shutdown(ftpSessionTls);
+    SSL_free(ftpSessionTls);
+    ftpSessionTls = NULL;
+  }
 }
 
 /**
@@ -487,6 +1490,7 @@ void storCommand(int ftpServerSocket, char *buffer, char *serverHomeDirectory)
     }
     else
     {
+      lastTransferBytes += noOfBytes;
       resetBufferMemory(buffer);
       strcpy(buffer, "Code[200]: Sucessfully saved file ");
       strcat(buffer, sourceFileName);
@@ -511,7 +1515,7 @@ void retrCommand(int ftpServerSocket, char *buffer, char *serverHomeDirectory)
 {
   // intialize variables
   int size, noOfBytes;
-  char fileContent[1024];
+  char fileContent[RETR_CHUNK_BYTES];
   // allocate file path memory size
   char *fileName = malloc(strlen(buffer) - 4);
   // copy the file path
@@ -522,10 +1526,64 @@ void retrCommand(int ftpServerSocket, char *buffer, char *serverHomeDirectory)
   strcat(filePathInServer, fileName);
   // open the file
   int serverFileDesc = open(filePathInServer, O_RDONLY, 0777);
+  struct stat fileStatus;
+  off_t fileOffset = 0;
+  // send the file without copying it through user space, the kernel encrypts it when kTLS is on
+  bool zeroCopy = ftpSessionTls == NULL || BIO_get_ktls_send(SSL_get_wbio(ftpSessionTls));
+  if (zeroCopy && serverFileDesc != -1 && fstat(serverFileDesc, &fileStatus) == 0)
+  {
+    while (fileOffset < fileStatus.st_size)
+    {
+      ssize_t sentBytes;
+      struct timespec sendStartTime;
+      clock_gettime(CLOCK_MONOTONIC, &sendStartTime);
+      if (ftpSessionTls != NULL)
+      {
+        sentBytes = SSL_sendfile(ftpSessionTls, serverFileDesc, fileOffset, fileStatus.st_size - fileOffset, 0);
+      }
+      else
+      {
+        // sendfile moves the offset it is given, the offset is advanced below for both paths
+        off_t sendOffset = fileOffset;
+        sentBytes = sendfile(ftpServerSocket, serverFileDesc, &sendOffset, fileStatus.st_size - fileOffset);
+      }
+      // the client is gone, sending the rest by copy would fail as well
+      if (sentBytes < 0 && errno != EINVAL && errno != ENOSYS)
+      {
+        sessionFailed = true;
+      }
+      else if (sentBytes <= 0)
+      {
+        break;
+      }
+      else
+      {
+        fileOffset += sentBytes;
+        checkTransferRate(&sendStartTime, sentBytes);
+      }
+      // stop a client that is gone or reads too slowly
+      if (sessionFailed)
+      {
+        lastTransferBytes = fileOffset;
+        close(serverFileDesc);
+        return;
+      }
+    }
+    // fall back to the copy loop below for whatever was not sent
+    lastTransferBytes = fileOffset;
+    lseek(serverFileDesc, fileOffset, SEEK_SET);
+    if (fileOffset == fileStatus.st_size)
+    {
+      // no reply is sent after the file data, record the transfer as complete
+      lastReplyCode = 226;
+      close(serverFileDesc);
+      return;
+    }
+  }
   while (1)
   {
     // read the file contents
-    noOfBytes = read(serverFileDesc, fileContent, 1024);
+    noOfBytes = read(serverFileDesc, fileContent, sizeof(fileContent));
     // if failed to read file, send the error meesage
     if (noOfBytes == -1)
     {
@@ -540,13 +1598,16 @@ void retrCommand(int ftpServerSocket, char *buffer, char *serverHomeDirectory)
     size = noOfBytes;
     // if size is zero, file read completly
     if (size == 0)
+    {
+      lastReplyCode = 226;
       break;
+    }
     else
     {
-      resetBufferMemory(buffer);
-      strcpy(buffer, fileContent);
-      // send file content to the client to download
-      sentDataToClient(ftpServerSocket, buffer);
+      // send file content to the client to download, through the userspace TLS session after AUTH TLS
+      if (!sendToClient(ftpServerSocket, fileContent, size))
+        break;
+      lastTransferBytes += size;
     }
   }
   // close the file descriptor